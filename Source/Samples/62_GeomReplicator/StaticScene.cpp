@@ -21,6 +21,8 @@
 //
 
 #include <Urho3D/Core/CoreEvents.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Core/WorkQueue.h>
 #include <Urho3D/Engine/Engine.h>
 #include <Urho3D/Graphics/Camera.h>
 #include <Urho3D/Graphics/Graphics.h>
@@ -29,12 +31,22 @@
 #include <Urho3D/Graphics/Octree.h>
 #include <Urho3D/Graphics/Renderer.h>
 #include <Urho3D/Graphics/StaticModel.h>
+#include <Urho3D/Graphics/Terrain.h>
 #include <Urho3D/Graphics/Geometry.h>
 #include <Urho3D/Graphics/VertexBuffer.h>
 #include <Urho3D/Graphics/IndexBuffer.h>
 #include <Urho3D/Container/ArrayPtr.h>
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/Sort.h>
 #include <Urho3D/Input/Input.h>
+#include <Urho3D/IO/File.h>
+#include <Urho3D/IO/FileSystem.h>
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/IO/VectorBuffer.h>
+#include <Urho3D/Resource/Image.h>
 #include <Urho3D/Resource/ResourceCache.h>
+#include <Urho3D/Resource/ResourceEvents.h>
 #include <Urho3D/Scene/Scene.h>
 #include <Urho3D/UI/Font.h>
 #include <Urho3D/UI/Text.h>
@@ -43,6 +55,7 @@
 #include <Urho3D/Graphics/DebugRenderer.h>
 
 #include <stdio.h>
+#include <math.h>
 
 #include "StaticScene.h"
 
@@ -52,6 +65,8 @@
 //=============================================================================
 #define ONE_SEC_DURATION 1000
 
+static const Vector3 CameraStartPos(-4.0f, 3.0f, -50.0f);
+
 // wrap vert index visualization helper around preprocessor for optimization
 #if defined(_DEBUG) || defined(DEBUG)
 #define VERT_INDEX_VISUAL
@@ -59,185 +74,1164 @@
 
 //=============================================================================
 //=============================================================================
+const float GeomReplicator::DefaultCellSize  = 2.0f;
+const float GeomReplicator::DefaultDecayRate = 3.0f;
+const float GeomReplicator::MinBendLength    = 0.001f;
+
+// instance attribute quantization
+static const float YawOnlyEpsilon     = 0.0001f;
+static const float SmallestThreeRange = 0.7071068f;
+
+static unsigned QuantizeRange(float value, float minValue, float range, unsigned maxQ)
+{
+    if ( range <= 0.0f )
+        return 0;
+
+    int q = (int)((value - minValue) / range * (float)maxQ + 0.5f);
+    return (unsigned)Clamp(q, 0, (int)maxQ);
+}
+
+static float DequantizeRange(unsigned q, float minValue, float range, unsigned maxQ)
+{
+    return minValue + range * (float)q / (float)maxQ;
+}
+
+static unsigned EncodeSmallestThree(const Quaternion &rot)
+{
+    float comp[4] = { rot.w_, rot.x_, rot.y_, rot.z_ };
+    unsigned largest = 0;
+
+    for ( unsigned i = 1; i < 4; ++i )
+    {
+        if ( Abs(comp[i]) > Abs(comp[largest]) )
+            largest = i;
+    }
+
+    // q and -q are the same rotation, keep the dropped component positive
+    float sign = comp[largest] < 0.0f ? -1.0f : 1.0f;
+    unsigned packed = largest << 30;
+    unsigned shift = 20;
+
+    for ( unsigned i = 0; i < 4; ++i )
+    {
+        if ( i == largest )
+            continue;
+
+        packed |= QuantizeRange(comp[i] * sign, -SmallestThreeRange, 2.0f * SmallestThreeRange, 1023) << shift;
+        shift -= 10;
+    }
+
+    return packed;
+}
+
+static Quaternion DecodeSmallestThree(unsigned packed)
+{
+    float comp[4];
+    unsigned largest = packed >> 30;
+    unsigned shift = 20;
+    float sumSquares = 0.0f;
+
+    for ( unsigned i = 0; i < 4; ++i )
+    {
+        if ( i == largest )
+            continue;
+
+        comp[i] = DequantizeRange((packed >> shift) & 1023, -SmallestThreeRange, 2.0f * SmallestThreeRange, 1023);
+        sumSquares += comp[i] * comp[i];
+        shift -= 10;
+    }
+
+    comp[largest] = sqrtf(Max(1.0f - sumSquares, 0.0f));
+
+    Quaternion rot(comp[0], comp[1], comp[2], comp[3]);
+    rot.Normalize();
+    return rot;
+}
+
+// octahedral, folded around y
+static unsigned short EncodeOctNormal(const Vector3 &normal)
+{
+    Vector3 n = normal / (Abs(normal.x_) + Abs(normal.y_) + Abs(normal.z_));
+    float u = n.x_;
+    float v = n.z_;
+
+    if ( n.y_ < 0.0f )
+    {
+        u = (1.0f - Abs(n.z_)) * (n.x_ >= 0.0f ? 1.0f : -1.0f);
+        v = (1.0f - Abs(n.x_)) * (n.z_ >= 0.0f ? 1.0f : -1.0f);
+    }
+
+    return (unsigned short)((QuantizeRange(u, -1.0f, 2.0f, 255) << 8) | QuantizeRange(v, -1.0f, 2.0f, 255));
+}
+
+static Vector3 DecodeOctNormal(unsigned short packed)
+{
+    float u = DequantizeRange(packed >> 8, -1.0f, 2.0f, 255);
+    float v = DequantizeRange(packed & 255, -1.0f, 2.0f, 255);
+    Vector3 n(u, 1.0f - Abs(u) - Abs(v), v);
+
+    if ( n.y_ < 0.0f )
+    {
+        n.x_ = (1.0f - Abs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        n.z_ = (1.0f - Abs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+    }
+
+    return n.Normalized();
+}
+
+// wind phase offset per instance - derived from the index rather than Random(), which
+// isn't safe on the bake workers and wouldn't give the same field twice
+static float WindPhase(unsigned index)
+{
+    unsigned h = index * 2654435761u;
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+
+    return (float)(h & 0xffff) / 65536.0f * 0.2f;
+}
+
+// terrain placement
+struct ConformContext
+{
+    const float    *heightData;
+    IntVector2      numVertices;
+    Vector3         spacing;
+    Vector2         origin;
+    Matrix3x4       toTerrain;
+    Matrix3x4       fromTerrain;
+    Quaternion      terrainRot;
+    Quaternion      toLocalRot;
+    float           minNormalY;
+    bool            alignToSlope;
+    PRotScale      *instances;
+    unsigned char  *keepList;
+};
+
+static inline float RawTerrainHeight(const ConformContext &ctx, int x, int z)
+{
+    x = Clamp(x, 0, ctx.numVertices.x_ - 1);
+    z = Clamp(z, 0, ctx.numVertices.y_ - 1);
+    return ctx.heightData[z * ctx.numVertices.x_ + x];
+}
+
+static void ConformToTerrainWork(const WorkItem* item, unsigned threadIndex)
+{
+    const ConformContext &ctx = *(const ConformContext*)item->aux_;
+    PRotScale *begInst = (PRotScale*)item->start_;
+    PRotScale *endInst = (PRotScale*)item->end_;
+
+    for ( PRotScale *qp = begInst; qp < endInst; ++qp )
+    {
+        // same triangle interpolation as Terrain::GetHeight(), plus the plane normal of that triangle
+        Vector3 terrainPos = ctx.toTerrain * qp->pos;
+        float xPos = (terrainPos.x_ - ctx.origin.x_) / ctx.spacing.x_;
+        float zPos = (terrainPos.z_ - ctx.origin.y_) / ctx.spacing.z_;
+        int x = FloorToInt(xPos);
+        int z = FloorToInt(zPos);
+        float xFrac = xPos - (float)x;
+        float zFrac = zPos - (float)z;
+        float height, dhdx, dhdz;
+
+        if ( xFrac + zFrac >= 1.0f )
+        {
+            float h1 = RawTerrainHeight(ctx, x + 1, z + 1);
+            float h2 = RawTerrainHeight(ctx, x, z + 1);
+            float h3 = RawTerrainHeight(ctx, x + 1, z);
+
+            height = h1 * (xFrac + zFrac - 1.0f) + h2 * (1.0f - xFrac) + h3 * (1.0f - zFrac);
+            dhdx = (h1 - h2) / ctx.spacing.x_;
+            dhdz = (h1 - h3) / ctx.spacing.z_;
+        }
+        else
+        {
+            float h1 = RawTerrainHeight(ctx, x, z);
+            float h2 = RawTerrainHeight(ctx, x + 1, z);
+            float h3 = RawTerrainHeight(ctx, x, z + 1);
+
+            height = h1 * (1.0f - xFrac - zFrac) + h2 * xFrac + h3 * zFrac;
+            dhdx = (h2 - h1) / ctx.spacing.x_;
+            dhdz = (h3 - h1) / ctx.spacing.z_;
+        }
+
+        Vector3 worldNormal = ctx.terrainRot * Vector3(-dhdx, 1.0f, -dhdz).Normalized();
+        unsigned idx = (unsigned)(qp - ctx.instances);
+
+        // too steep
+        if ( worldNormal.y_ < ctx.minNormalY )
+        {
+            ctx.keepList[idx] = 0;
+            continue;
+        }
+
+        terrainPos.y_ = height;
+        qp->pos = ctx.fromTerrain * terrainPos;
+        qp->normal = ctx.toLocalRot * worldNormal;
+
+        if ( ctx.alignToSlope )
+        {
+            qp->rot = Quaternion(Vector3::UP, qp->normal) * qp->rot;
+        }
+
+        ctx.keepList[idx] = 1;
+    }
+}
+
+//=============================================================================
+//=============================================================================
+GeomPrototype::GeomPrototype(Model *model)
+    : sourceModel_(model), elementMask_(0), vertexSize_(0), numVertices_(0), numIndeces_(0)
+{
+    Geometry *pGeometry = model ? model->GetGeometry(0, 0) : 0;
+    VertexBuffer *pVbuffer = pGeometry ? pGeometry->GetVertexBuffer(0) : 0;
+    IndexBuffer *pIbuffer = pGeometry ? pGeometry->GetIndexBuffer() : 0;
+
+    if ( !pVbuffer || !pIbuffer )
+    {
+        URHO3D_LOGERROR("GeomReplicator source model has no indexed geometry");
+        return;
+    }
+
+    // read the shadow copies, locking the model's own buffers would re-upload them on unlock
+    const unsigned char *pVertexData = pVbuffer->GetShadowData();
+    const unsigned char *pIndexData = pIbuffer->GetShadowData();
+
+    if ( !pVertexData || !pIndexData )
+    {
+        URHO3D_LOGERROR("GeomReplicator source model buffers are not shadowed");
+        return;
+    }
+
+    unsigned vertexSize = pVbuffer->GetVertexSize();
+    unsigned numVertices = pVbuffer->GetVertexCount();
+    unsigned numIndeces = pIbuffer->GetIndexCount();
+    bool largeIndices = pIbuffer->GetIndexSize() == sizeof(unsigned);
+
+    // the source geom is kept with 16-bit indices
+    if ( numVertices == 0 || numIndeces == 0 || numVertices > 65536 )
+    {
+        URHO3D_LOGERROR("GeomReplicator source model geometry is empty or too large");
+        return;
+    }
+
+    SharedArrayPtr<unsigned short> indexData(new unsigned short[numIndeces]);
+
+    for ( unsigned i = 0; i < numIndeces; ++i )
+    {
+        unsigned index = largeIndices ? ((const unsigned*)pIndexData)[i] : ((const unsigned short*)pIndexData)[i];
+
+        if ( index >= numVertices )
+        {
+            URHO3D_LOGERROR("GeomReplicator source model has an index out of range");
+            return;
+        }
+
+        indexData[i] = (unsigned short)index;
+    }
+
+    // cpy orig buffs
+    vertexData_ = new unsigned char[vertexSize * numVertices];
+    memcpy(vertexData_.Get(), pVertexData, vertexSize * numVertices);
+    indexData_   = indexData;
+    elementMask_ = pVbuffer->GetElementMask();
+    vertexSize_  = vertexSize;
+    numVertices_ = numVertices;
+    numIndeces_  = numIndeces;
+}
+
+GeomPrototype* GeomPrototypeCache::GetPrototype(Model *model, GeomPrototype *stale)
+{
+    HashMap<Model*, SharedPtr<GeomPrototype> >::Iterator itProto = prototypeMap_.Find(model);
+
+    // a stale entry can share the address of a model that was freed, or hold the data from before a reload
+    // - the first replicator to see the reload rebuilds it, the others pick up the rebuilt one
+    if ( itProto != prototypeMap_.End() && itProto->second_->GetSourceModel() == model && itProto->second_ != stale )
+        return itProto->second_;
+
+    SharedPtr<GeomPrototype> prototype(new GeomPrototype(model));
+
+    if ( !prototype->IsValid() )
+    {
+        prototypeMap_.Erase(model);
+        return 0;
+    }
+
+    prototypeMap_[model] = prototype;
+
+    return prototype;
+}
+
+void GeomPrototypeCache::ReleaseUnused()
+{
+    for ( HashMap<Model*, SharedPtr<GeomPrototype> >::Iterator itProto = prototypeMap_.Begin(); itProto != prototypeMap_.End(); )
+    {
+        if ( itProto->second_->Refs() == 1 )
+        {
+            itProto = prototypeMap_.Erase(itProto);
+        }
+        else
+        {
+            ++itProto;
+        }
+    }
+}
+
+//=============================================================================
+//=============================================================================
+void GeomReplicator::RegisterObject(Context* context)
+{
+    context->RegisterFactory<GeomReplicator>();
+
+    if ( !context->GetSubsystem<GeomPrototypeCache>() )
+    {
+        context->RegisterSubsystem(new GeomPrototypeCache(context));
+    }
+
+    URHO3D_COPY_BASE_ATTRIBUTES(StaticModel);
+
+    // the model only holds the output buffers, save the source instead
+    // - material is re-added after it so that it's applied once the geometry exists
+    context->RemoveAttribute<GeomReplicator>("Model");
+    context->RemoveAttribute<GeomReplicator>("Material");
+    URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Source Model", GetSourceModelAttr, SetSourceModelAttr, ResourceRef, ResourceRef(Model::GetTypeStatic()), AM_DEFAULT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Material", GetMaterialsAttr, SetMaterialsAttr, ResourceRefList, ResourceRefList(Material::GetTypeStatic()), AM_DEFAULT);
+    URHO3D_ATTRIBUTE("Normal Override", Vector3, normalOverride_, Vector3::ZERO, AM_DEFAULT);
+    URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Instances", GetInstancesAttr, SetInstancesAttr, PODVector<unsigned char>, Variant::emptyBuffer, AM_FILE | AM_NOEDIT);
+}
+
+GeomReplicator::~GeomReplicator()
+{
+    CancelBake();
+    ReleasePrototype();
+}
+
+void GeomReplicator::ApplyAttributes()
+{
+    StaticModel::ApplyAttributes();
+
+    // re-bake what was loaded without stalling the load
+    if ( instancesDirty_ )
+    {
+        instancesDirty_ = false;
+
+        CancelBake();
+        StartAsyncBake(normalOverride_);
+    }
+}
+
+void GeomReplicator::OnNodeSet(Node* node)
+{
+    StaticModel::OnNodeSet(node);
+
+    // removed mid-bake
+    if ( !node )
+    {
+        CancelBake();
+    }
+}
+
+void GeomReplicator::SetSourceModel(Model *model)
+{
+    if ( model == sourceModel_ )
+        return;
+
+    CancelBake();
+
+    ReleasePrototype();
+
+    if ( sourceModel_ )
+    {
+        UnsubscribeFromEvent(sourceModel_, E_RELOADFINISHED);
+    }
+
+    sourceModel_ = model;
+    prototype_ = model ? GetSubsystem<GeomPrototypeCache>()->GetPrototype(model) : 0;
+    ClearReplicatedState();
+
+    if ( model )
+    {
+        SubscribeToEvent(model, E_RELOADFINISHED, URHO3D_HANDLER(GeomReplicator, HandleSourceReloaded));
+    }
+
+    // no model, or nothing usable in it - GetPrototype() has logged why
+    if ( !prototype_ )
+    {
+        SetModel( 0 );
+        return;
+    }
+
+    // own only the output buffers, filled in by the bake
+    SharedPtr<VertexBuffer> vbuffer(new VertexBuffer(context_));
+    SharedPtr<IndexBuffer> ibuffer(new IndexBuffer(context_));
+    vbuffer->SetShadowed(true);
+    ibuffer->SetShadowed(true);
+
+    SharedPtr<Geometry> geometry(new Geometry(context_));
+    geometry->SetVertexBuffer(0, vbuffer);
+    geometry->SetIndexBuffer(ibuffer);
+
+    SharedPtr<Model> outModel(new Model(context_));
+    outModel->SetNumGeometries(1);
+    outModel->SetNumGeometryLodLevels(0, 1);
+    outModel->SetGeometry(0, 0, geometry);
+    outModel->SetBoundingBox(model->GetBoundingBox());
+
+    SetModel( outModel );
+}
+
+void GeomReplicator::ReleasePrototype()
+{
+    if ( !prototype_ )
+        return;
+
+    prototype_.Reset();
+
+    // the cache may already be gone while the context shuts down
+    GeomPrototypeCache *protoCache = GetSubsystem<GeomPrototypeCache>();
+
+    if ( protoCache )
+    {
+        protoCache->ReleaseUnused();
+    }
+}
+
 unsigned GeomReplicator::Replicate(const PODVector<PRotScale> &qplist, const Vector3 &normalOverride)
+{
+    CancelBake();
+
+    if ( !PrepareBake(qplist, normalOverride) )
+    {
+        ClearReplication();
+        return 0;
+    }
+
+    BakeVerts(0, instanceList_.Size(), bake_.bbox);
+    BakeIndeces(0, instanceList_.Size());
+    CommitBake();
+
+    return qplist.Size();
+}
+
+// async replication order
+struct InstanceDistance
+{
+    bool operator <(const InstanceDistance& rhs) const { return distSq < rhs.distSq; }
+
+    float       distSq;
+    unsigned    index;
+};
+
+bool GeomReplicator::ReplicateAsync(const PODVector<PRotScale> &qplist, const Vector3 &normalOverride, const Vector3 &priorityPos)
+{
+    CancelBake();
+
+    // nearest first, chunks are contiguous instance ranges
+    Vector3 localPos = node_ ? node_->GetWorldTransform().Inverse() * priorityPos : priorityPos;
+    PODVector<InstanceDistance> distList(qplist.Size());
+
+    for ( unsigned i = 0; i < qplist.Size(); ++i )
+    {
+        distList[i].distSq = (qplist[i].pos - localPos).LengthSquared();
+        distList[i].index  = i;
+    }
+
+    Sort(distList.Begin(), distList.End());
+
+    PODVector<PRotScale> sortedList(qplist.Size());
+
+    for ( unsigned i = 0; i < distList.Size(); ++i )
+    {
+        sortedList[i] = qplist[distList[i].index];
+    }
+
+    instanceList_ = sortedList;
+
+    return StartAsyncBake(normalOverride);
+}
+
+unsigned GeomReplicator::ConformToTerrain(Terrain *terrain, PODVector<PRotScale> &qplist, bool alignToSlope, float maxSlope)
+{
+    if ( qplist.Empty() )
+        return 0;
+
+    if ( !terrain || !terrain->GetNode() || terrain->GetHeightData().Null() )
+    {
+        URHO3D_LOGWARNING("GeomReplicator::ConformToTerrain() - terrain has no height data, nothing was placed");
+        return 0;
+    }
+
+    Node *terrainNode = terrain->GetNode();
+    Matrix3x4 repWorld = node_ ? node_->GetWorldTransform() : Matrix3x4::IDENTITY;
+    Quaternion repWorldRot = node_ ? node_->GetWorldRotation() : Quaternion::IDENTITY;
+    IntVector2 numPatches = terrain->GetNumPatches();
+    PODVector<unsigned char> keepList(qplist.Size());
+
+    // hoist everything Terrain::GetHeight()/GetNormal() would compute per call
+    ConformContext ctx;
+    ctx.heightData   = terrain->GetHeightData().Get();
+    ctx.numVertices  = terrain->GetNumVertices();
+    ctx.spacing      = terrain->GetSpacing();
+    ctx.origin       = Vector2(-0.5f * numPatches.x_ * terrain->GetPatchSize() * ctx.spacing.x_,
+                               -0.5f * numPatches.y_ * terrain->GetPatchSize() * ctx.spacing.z_);
+    ctx.toTerrain    = terrainNode->GetWorldTransform().Inverse() * repWorld;
+    ctx.fromTerrain  = repWorld.Inverse() * terrainNode->GetWorldTransform();
+    ctx.terrainRot   = terrainNode->GetWorldRotation();
+    ctx.toLocalRot   = repWorldRot.Inverse();
+    ctx.minNormalY   = Cos(Clamp(maxSlope, 0.0f, 90.0f));
+    ctx.alignToSlope = alignToSlope;
+    ctx.instances    = &qplist[0];
+    ctx.keepList     = &keepList[0];
+
+    // split into ranges, the main thread works on them too while completing
+    WorkQueue *queue = GetSubsystem<WorkQueue>();
+    unsigned numWorkers = queue->GetNumThreads() + 1;
+    unsigned rangeSize = Max((qplist.Size() + numWorkers - 1) / numWorkers, (unsigned)ConformWork_MinInstances);
+
+    for ( unsigned beg = 0; beg < qplist.Size(); beg += rangeSize )
+    {
+        unsigned end = Min(beg + rangeSize, qplist.Size());
+
+        SharedPtr<WorkItem> item = queue->GetFreeItem();
+        item->priority_     = M_MAX_UNSIGNED;
+        item->workFunction_ = ConformToTerrainWork;
+        item->aux_          = &ctx;
+        item->start_        = &qplist[beg];
+        item->end_          = &qplist[0] + end;
+        queue->AddWorkItem(item);
+    }
+
+    queue->Complete(M_MAX_UNSIGNED);
+
+    // drop what's too steep, keeping the order
+    unsigned numKept = 0;
+
+    for ( unsigned i = 0; i < qplist.Size(); ++i )
+    {
+        if ( keepList[i] )
+        {
+            qplist[numKept++] = qplist[i];
+        }
+    }
+
+    qplist.Resize(numKept);
+
+    return numKept;
+}
+
+bool GeomReplicator::PrepareBake(const PODVector<PRotScale> &qplist, const Vector3 &normalOverride)
+{
+    if ( &qplist != &instanceList_ )
+    {
+        instanceList_ = qplist;
+    }
+    normalOverride_ = normalOverride;
+
+    // model set directly with SetModel(), use it as the source
+    if ( !prototype_ && GetModel() )
+    {
+        SetSourceModel( GetModel() );
+    }
+
+    if ( !prototype_ )
+        return false;
+
+    // for movement
+    numVertsPerGeom = prototype_->GetNumVertices();
+
+    // allocate the output up front, bakes fill in instance ranges
+    unsigned numInstances = instanceList_.Size();
+    unsigned newIdxCount = numInstances * prototype_->GetNumIndeces();
+
+    bake_.largeIndices = newIdxCount > 1024*64;
+    bake_.vertexData = new unsigned char[numInstances * prototype_->GetNumVertices() * prototype_->GetVertexSize()];
+    bake_.indexData = new unsigned char[newIdxCount * (bake_.largeIndices ? sizeof(unsigned) : sizeof(unsigned short))];
+    bake_.animatedVertexList.Resize(numInstances * prototype_->GetNumVertices());
+    bake_.instancePosList.Resize(numInstances);
+    bake_.bbox.Clear();
+
+    return true;
+}
+
+void GeomReplicator::BakeVerts(unsigned begInst, unsigned endInst, BoundingBox &bbox)
+{
+    const PODVector<PRotScale> &qplist = instanceList_;
+    unsigned uElementMask = prototype_->GetElementMask();
+    unsigned vertexSize = prototype_->GetVertexSize();
+    unsigned numVertices = prototype_->GetNumVertices();
+    unsigned char *pVertexData = bake_.vertexData.Get();
+    bool overrideNormal = normalOverride_ != Vector3::ZERO;
+
+    // retain bbox as the size grows
+    bbox.Clear();
+
+    // replicate
+    for ( unsigned i = begInst; i < endInst && !bakeCancelled_; ++i )
+    {
+        Quaternion rot(qplist[i].rot);
+        Matrix3x4 mat(qplist[i].pos, rot, qplist[i].scale);
+        unsigned begOfGeomAnimVertIndex = i * numVertices;
+
+        bake_.instancePosList[i] = qplist[i].pos;
+
+        for ( unsigned j = 0; j < numVertices; ++j )
+        {
+            const unsigned char *pOrigDataAlign = prototype_->GetVertexData() + j * vertexSize;
+            unsigned char *pDataAlign = (unsigned char *)(pVertexData + (i * numVertices + j) * vertexSize);
+            unsigned sizeRemaining = vertexSize;
+
+            // position
+            const Vector3 &vPos = *reinterpret_cast<const Vector3*>( pOrigDataAlign );
+            Vector3 &nPos = *reinterpret_cast<Vector3*>( pDataAlign );
+            nPos = mat * vPos;
+
+            pOrigDataAlign += sizeof(Vector3);
+            pDataAlign     += sizeof(Vector3);
+            sizeRemaining  -= sizeof(Vector3);
+
+            // for movement
+            MoveAccumulator movPt;
+            movPt.origPos = nPos;
+
+            // sync timers for verts in the same geom
+            movPt.timeAccumlated = WindPhase(i);
+            bake_.animatedVertexList[begOfGeomAnimVertIndex + j] = movPt;
+
+            // bbox
+            bbox.Merge(nPos);
+
+            // normal - let's not make any assumptions that the normals exist for every model
+            // - a per instance ground normal takes precedence over the override
+            if ( uElementMask & MASK_NORMAL )
+            {
+                const Vector3 &vNorm = *reinterpret_cast<const Vector3*>( pOrigDataAlign );
+                Vector3 &norm = *reinterpret_cast<Vector3*>( pDataAlign );
+
+                if ( qplist[i].normal != Vector3::ZERO )
+                {
+                    norm = qplist[i].normal;
+                }
+                else if ( !overrideNormal )
+                {
+                    norm = rot * vNorm;
+                }
+                else
+                {
+                    norm = normalOverride_;
+                }
+
+                pOrigDataAlign += sizeof(Vector3);
+                pDataAlign     += sizeof(Vector3);
+                sizeRemaining  -= sizeof(Vector3);
+            }
+
+            // how about tangents?
+
+            // copy everything else excluding what's copied already
+            memcpy(pDataAlign, pOrigDataAlign, sizeRemaining);
+        }
+    }
+}
+
+void GeomReplicator::BakeIndeces(unsigned begInst, unsigned endInst)
+{
+    unsigned numVertices = prototype_->GetNumVertices();
+    unsigned numIndeces = prototype_->GetNumIndeces();
+    const unsigned short *origIdxBuff = prototype_->GetIndexData();
+
+    // replicate indeces
+    if ( bake_.largeIndices )
+    {
+        unsigned *newIndexList = reinterpret_cast<unsigned*>( bake_.indexData.Get() );
+
+        for (unsigned i = begInst; i < endInst; ++i)
+        {
+            for (unsigned j = 0; j < numIndeces; ++j)
+            {
+                newIndexList[i*numIndeces + j] = i*numVertices + origIdxBuff[j];
+            }
+        }
+    }
+    else
+    {
+        unsigned short *newIndexList = reinterpret_cast<unsigned short*>( bake_.indexData.Get() );
+
+        for (unsigned i = begInst; i < endInst; ++i)
+        {
+            for (unsigned j = 0; j < numIndeces; ++j)
+            {
+                newIndexList[i*numIndeces + j] = i*numVertices + origIdxBuff[j];
+            }
+        }
+    }
+}
+
+void GeomReplicator::CommitBake()
 {
     Geometry *pGeometry = GetModel()->GetGeometry(0, 0);
     VertexBuffer *pVbuffer = pGeometry->GetVertexBuffer(0);
     IndexBuffer *pIbuffer = pGeometry->GetIndexBuffer();
-    unsigned uElementMask = pVbuffer->GetElementMask();
-    unsigned vertexSize = pVbuffer->GetVertexSize();
-    unsigned numVertices = pVbuffer->GetVertexCount();
+    unsigned numInstances = instanceList_.Size();
+    unsigned newIdxCount = numInstances * prototype_->GetNumIndeces();
+
+    if ( numInstances == 0 )
+    {
+        ClearReplication();
+        return;
+    }
+
+    pVbuffer->SetSize( prototype_->GetNumVertices() * numInstances, prototype_->GetElementMask() );
+    pVbuffer->SetData( bake_.vertexData.Get() );
+    pIbuffer->SetSize( newIdxCount, bake_.largeIndices );
+    pIbuffer->SetData( bake_.indexData.Get() );
+
+    // set draw range and bounding box
+    pGeometry->SetDrawRange(TRIANGLE_LIST, 0, newIdxCount);
+    SetBoundingBox( bake_.bbox );
+
+    FinalizeBake();
+}
+
+void GeomReplicator::FinalizeBake()
+{
+    unsigned numInstances = instanceList_.Size();
+
+    bake_.vertexData.Reset();
+    bake_.indexData.Reset();
+
+    // for movement and interaction
+    animatedVertexList_.Swap(bake_.animatedVertexList);
+    instancePosList_.Swap(bake_.instancePosList);
+    bake_.animatedVertexList.Clear();
+    bake_.instancePosList.Clear();
+
+    instanceBendList_.Clear();
+    instanceBendList_.Resize(numInstances);
+    bentInstanceList_.Clear();
+
+    for ( unsigned i = 0; i < numInstances; ++i )
+    {
+        instanceBendList_[i] = InstanceBend();
+    }
+
+    currentVertexIdx_ = 0;
+
+    BuildSpatialHash();
+
+    #ifdef VERT_INDEX_VISUAL
+    // text3d dbg
+    for ( unsigned i = 0; i < nodeText3DVertList_.Size(); ++i )
+    {
+        nodeText3DVertList_[i]->Remove();
+    }
+    nodeText3DVertList_.Clear();
+
+    if ( GetScene() )
+    {
+        ResourceCache* cache = GetSubsystem<ResourceCache>();
+
+        for ( unsigned j = 0; j < numVertsPerGeom; ++j )
+        {
+            Node* textNode = GetScene()->CreateChild();
+            textNode->SetTemporary(true);
+            textNode->SetPosition(animatedVertexList_[j].origPos + Vector3(0.0f, 0.1f, 0.0f));
+            textNode->SetEnabled(showGeomVertIndeces_);
+
+            Text3D* text3d = textNode->CreateComponent<Text3D>();
+            text3d->SetText( String(j) );
+            text3d->SetFont(cache->GetResource<Font>("Fonts/Anonymous Pro.ttf"), 12);
+            text3d->SetColor(Color::YELLOW);
+            text3d->SetFaceCameraMode(FC_ROTATE_XYZ);
+
+            nodeText3DVertList_.Push(textNode);
+        }
+    }
+    #endif
+}
+
+bool GeomReplicator::StartAsyncBake(const Vector3 &normalOverride)
+{
+    // nothing to bake, no completion event will follow
+    if ( !PrepareBake(instanceList_, normalOverride) || instanceList_.Empty() )
+    {
+        ClearReplication();
+        return false;
+    }
+
+    // the old replication no longer matches the buffers
+    ClearReplicatedState();
+
+    // size the buffers once and draw nothing until the first chunk is published
+    Geometry *pGeometry = GetModel()->GetGeometry(0, 0);
+    unsigned numInstances = instanceList_.Size();
+
+    pGeometry->GetVertexBuffer(0)->SetSize( prototype_->GetNumVertices() * numInstances, prototype_->GetElementMask() );
+    pGeometry->GetIndexBuffer()->SetSize( numInstances * prototype_->GetNumIndeces(), bake_.largeIndices );
+    pGeometry->SetDrawRange(TRIANGLE_LIST, 0, 0, 0, 0);
+
+    publishedChunks_ = 0;
+    publishedBox_.Clear();
+    bakeCancelled_ = false;
+
+    unsigned numChunks = (numInstances + BakeChunk_Instances - 1) / BakeChunk_Instances;
+    bakeChunks_.Resize(numChunks);
+
+    for ( unsigned i = 0; i < numChunks; ++i )
+    {
+        BakeChunk &chunk = bakeChunks_[i];
+        chunk.begInst = i * BakeChunk_Instances;
+        chunk.endInst = Min(chunk.begInst + (unsigned)BakeChunk_Instances, numInstances);
+        chunk.baked   = false;
+
+        // nearest chunks are at the front, give them the highest priority
+        chunk.workItem = new WorkItem();
+        chunk.workItem->workFunction_ = BakeChunkWork;
+        chunk.workItem->start_        = &chunk;
+        chunk.workItem->aux_          = this;
+        chunk.workItem->priority_     = numChunks - i;
+        chunk.workItem->sendEvent_    = true;
+    }
+
+    SubscribeToEvent(E_WORKITEMCOMPLETED, URHO3D_HANDLER(GeomReplicator, HandleBakeCompleted));
+    UpdateEventSubscription();
+
+    WorkQueue *queue = GetSubsystem<WorkQueue>();
+
+    for ( unsigned i = 0; i < numChunks; ++i )
+    {
+        queue->AddWorkItem(bakeChunks_[i].workItem);
+    }
+
+    return true;
+}
+
+void GeomReplicator::PublishBakedChunks()
+{
+    Geometry *pGeometry = GetModel()->GetGeometry(0, 0);
+    VertexBuffer *pVbuffer = pGeometry->GetVertexBuffer(0);
+    IndexBuffer *pIbuffer = pGeometry->GetIndexBuffer();
+    unsigned indexSize = bake_.largeIndices ? sizeof(unsigned) : sizeof(unsigned short);
+    unsigned numPublished = 0;
+
+    // only the baked front of the list is drawn, spread the uploads over frames
+    while ( publishedChunks_ < bakeChunks_.Size() && bakeChunks_[publishedChunks_].baked &&
+            numPublished < Publish_MaxChunksPerFrame )
+    {
+        const BakeChunk &chunk = bakeChunks_[publishedChunks_];
+        unsigned begVert = chunk.begInst * prototype_->GetNumVertices();
+        unsigned numVerts = (chunk.endInst - chunk.begInst) * prototype_->GetNumVertices();
+        unsigned begIdx = chunk.begInst * prototype_->GetNumIndeces();
+        unsigned numIdx = (chunk.endInst - chunk.begInst) * prototype_->GetNumIndeces();
+
+        pVbuffer->SetDataRange(bake_.vertexData.Get() + begVert * prototype_->GetVertexSize(), begVert, numVerts);
+        pIbuffer->SetDataRange(bake_.indexData.Get() + begIdx * indexSize, begIdx, numIdx);
+        publishedBox_.Merge(chunk.bbox);
+
+        ++publishedChunks_;
+        ++numPublished;
+    }
+
+    if ( numPublished == 0 )
+        return;
+
+    unsigned numInstances = bakeChunks_[publishedChunks_ - 1].endInst;
+    pGeometry->SetDrawRange(TRIANGLE_LIST, 0, numInstances * prototype_->GetNumIndeces(), 0, numInstances * prototype_->GetNumVertices());
+    SetBoundingBox( publishedBox_ );
+
+    if ( publishedChunks_ < bakeChunks_.Size() )
+        return;
+
+    // done
+    bakeChunks_.Clear();
+    UnsubscribeFromEvent(E_WORKITEMCOMPLETED);
+
+    FinalizeBake();
+    UpdateEventSubscription();
+
+    using namespace GeomReplicationCompleted;
+
+    VariantMap& eventData = GetEventDataMap();
+    eventData[P_NODE] = node_;
+    eventData[P_NUMINSTANCES] = instanceList_.Size();
+    SendEvent(E_GEOMREPLICATIONCOMPLETED, eventData);
+}
+
+void GeomReplicator::CancelBake()
+{
+    if ( bakeChunks_.Empty() )
+        return;
+
+    // chunks already running write into bake_, stop them early and wait
+    WorkQueue *queue = GetSubsystem<WorkQueue>();
+    bakeCancelled_ = true;
+
+    for ( unsigned i = 0; i < bakeChunks_.Size(); ++i )
+    {
+        if ( !queue->RemoveWorkItem(bakeChunks_[i].workItem) )
+        {
+            while ( !bakeChunks_[i].workItem->completed_ )
+            {
+                Time::Sleep(0);
+            }
+        }
+    }
+
+    bakeChunks_.Clear();
+    bakeCancelled_ = false;
+    UnsubscribeFromEvent(E_WORKITEMCOMPLETED);
+
+    bake_.vertexData.Reset();
+    bake_.indexData.Reset();
+    bake_.animatedVertexList.Clear();
+    bake_.instancePosList.Clear();
+
+    UpdateEventSubscription();
+}
+
+void GeomReplicator::ClearReplication()
+{
+    ClearReplicatedState();
+
+    // stop drawing the old field
+    if ( GetModel() )
+    {
+        GetModel()->GetGeometry(0, 0)->SetDrawRange(TRIANGLE_LIST, 0, 0, 0, 0);
+    }
+
+    #ifdef VERT_INDEX_VISUAL
+    for ( unsigned i = 0; i < nodeText3DVertList_.Size(); ++i )
+    {
+        nodeText3DVertList_[i]->Remove();
+    }
+    nodeText3DVertList_.Clear();
+    #endif
+}
+
+void GeomReplicator::ClearReplicatedState()
+{
+    animatedVertexList_.Clear();
+    instancePosList_.Clear();
+    instanceBendList_.Clear();
+    bentInstanceList_.Clear();
+    spatialHash_.Clear();
+    currentVertexIdx_ = 0;
+}
+
+void GeomReplicator::BakeChunkWork(const WorkItem* item, unsigned threadIndex)
+{
+    GeomReplicator *replicator = (GeomReplicator*)item->aux_;
+    BakeChunk *chunk = (BakeChunk*)item->start_;
+
+    replicator->BakeVerts(chunk->begInst, chunk->endInst, chunk->bbox);
+    replicator->BakeIndeces(chunk->begInst, chunk->endInst);
+}
+
+void GeomReplicator::HandleBakeCompleted(StringHash eventType, VariantMap& eventData)
+{
+    using namespace WorkItemCompleted;
+
+    void *item = eventData[P_ITEM].GetVoidPtr();
+
+    // published from HandleUpdate
+    for ( unsigned i = publishedChunks_; i < bakeChunks_.Size(); ++i )
+    {
+        if ( bakeChunks_[i].workItem.Get() == item )
+        {
+            bakeChunks_[i].baked = true;
+            break;
+        }
+    }
+}
 
-    // for movement
-    numVertsPerGeom = numVertices;
+void GeomReplicator::HandleSourceReloaded(StringHash eventType, VariantMap& eventData)
+{
+    SharedPtr<Model> model(sourceModel_);
 
-    // retain bbox as the size grows
-    BoundingBox bbox;
+    // replace the decoded geom in the cache, held until the replicator has picked it up again
+    SharedPtr<GeomPrototype> reloaded(GetSubsystem<GeomPrototypeCache>()->GetPrototype(model, prototype_));
 
-    // cpy orig vbuffs
-    unsigned origVertsBuffSize = vertexSize * numVertices;
-    SharedArrayPtr<unsigned char> origVertBuff( new unsigned char[origVertsBuffSize] );
-    const unsigned char *pVertexData = (const unsigned char*)pVbuffer->Lock(0, pVbuffer->GetVertexCount());
+    // rebuild the output as for a new source and re-bake what's placed
+    sourceModel_.Reset();
+    SetSourceModel(model);
 
-    if (pVertexData)
+    if ( prototype_ && !instanceList_.Empty() )
     {
-        memcpy(origVertBuff.Get(), pVertexData, origVertsBuffSize);
-        pVbuffer->Unlock();
+        StartAsyncBake(normalOverride_);
     }
+}
 
-    // replicate
-    pVbuffer->SetSize( numVertices * qplist.Size(), uElementMask );
-    pVertexData = (unsigned char*)pVbuffer->Lock(0, pVbuffer->GetVertexCount());
-    bool overrideNormal = normalOverride != Vector3::ZERO;
+void GeomReplicator::SetSourceModelAttr(const ResourceRef& value)
+{
+    ResourceCache* cache = GetSubsystem<ResourceCache>();
+    SetSourceModel(cache->GetResource<Model>(value.name_));
+}
 
-    if ( pVertexData )
-    {
-        for ( unsigned i = 0; i < qplist.Size(); ++i )
-        {
-            Quaternion rot(qplist[i].rot);
-            Matrix3x4 mat(qplist[i].pos, rot, qplist[i].scale);
-            unsigned begOfGeomAnimVertIndex = animatedVertexList_.Size();
+ResourceRef GeomReplicator::GetSourceModelAttr() const
+{
+    return GetResourceRef(sourceModel_, Model::GetTypeStatic());
+}
 
-            for ( unsigned j = 0; j < numVertices; ++j )
-            {
-                unsigned char *pOrigDataAlign = (unsigned char *)(origVertBuff.Get() + j * vertexSize);
-                unsigned char *pDataAlign = (unsigned char *)(pVertexData + (i * numVertices + j) * vertexSize);
-                unsigned sizeRemaining = vertexSize;
+void GeomReplicator::SetInstancesAttr(const PODVector<unsigned char>& value)
+{
+    CancelBake();
 
-                // position
-                const Vector3 &vPos = *reinterpret_cast<Vector3*>( pOrigDataAlign );
-                Vector3 &nPos = *reinterpret_cast<Vector3*>( pDataAlign );
-                nPos = mat * vPos;
+    instanceList_.Clear();
+    instancesDirty_ = true;
 
-                pOrigDataAlign += sizeof(Vector3);
-                pDataAlign     += sizeof(Vector3);
-                sizeRemaining  -= sizeof(Vector3);
+    if ( value.Empty() )
+        return;
 
-                // for movement
-                MoveAccumulator movPt;
-                movPt.origPos = nPos;
+    MemoryBuffer buf(value);
+    unsigned version = buf.ReadUByte();
 
-                // sync timers for verts in the same geom
-                if ( j > 0 )
-                {
-                    movPt.timeAccumlated = animatedVertexList_[begOfGeomAnimVertIndex].timeAccumlated;
-                }
-                animatedVertexList_.Push(movPt);
+    if ( version != InstanceFormat_Version )
+    {
+        URHO3D_LOGERROR("Unsupported GeomReplicator instance format");
+        return;
+    }
 
-                // bbox
-                bbox.Merge(nPos);
+    unsigned rotFormat = buf.ReadUByte();
+    unsigned flags = buf.ReadUByte();
+    unsigned numInstances = buf.ReadVLE();
+    Vector3 posMin = buf.ReadVector3();
+    Vector3 posRange = buf.ReadVector3() - posMin;
+    float scaleMin = buf.ReadFloat();
+    float scaleRange = buf.ReadFloat() - scaleMin;
 
-                #ifdef VERT_INDEX_VISUAL
-                // text3d dbg
-                if ( i == 0 )
-                {
-                    ResourceCache* cache = GetSubsystem<ResourceCache>();
-                    //Scene *scene = GetScene();
-                    Node* textNode = GetScene()->CreateChild();
-                    textNode->SetPosition(nPos + Vector3(0.0f, 0.1f, 0.0f));
-                    textNode->SetEnabled(false);
-
-                    Text3D* text3d = textNode->CreateComponent<Text3D>();
-                    text3d->SetText( String(j) );
-                    text3d->SetFont(cache->GetResource<Font>("Fonts/Anonymous Pro.ttf"), 12);
-                    text3d->SetColor(Color::YELLOW);
-                    text3d->SetFaceCameraMode(FC_ROTATE_XYZ);
-
-                    nodeText3DVertList_.Push(textNode);
-                }
-                #endif
+    if ( rotFormat != RotFormat_Yaw16 && rotFormat != RotFormat_SmallestThree32 )
+    {
+        URHO3D_LOGERROR("Unsupported GeomReplicator rotation format");
+        return;
+    }
 
-                // normal - let's not make any assumptions that the normals exist for every model
-                if ( uElementMask & MASK_NORMAL )
-                {
-                    const Vector3 &vNorm = *reinterpret_cast<Vector3*>( pOrigDataAlign );
-                    Vector3 &norm = *reinterpret_cast<Vector3*>( pDataAlign );
+    // don't trust the count, a truncated or corrupt buffer would otherwise allocate and read past the end
+    unsigned bytesPerInstance = 3 * sizeof(unsigned short) + 1;
+    bytesPerInstance += rotFormat == RotFormat_Yaw16 ? sizeof(unsigned short) : sizeof(unsigned);
+    bytesPerInstance += (flags & InstanceFlag_Normals) ? sizeof(unsigned short) : 0;
 
-                    if ( !overrideNormal )
-                    {
-                        norm = rot * vNorm;
-                    }
-                    else
-                    {
-                        norm = normalOverride;
-                    }
+    if ( (unsigned long long)numInstances * bytesPerInstance > buf.GetSize() - buf.GetPosition() )
+    {
+        URHO3D_LOGERROR("Truncated GeomReplicator instance data");
+        return;
+    }
 
-                    pOrigDataAlign += sizeof(Vector3);
-                    pDataAlign     += sizeof(Vector3);
-                    sizeRemaining  -= sizeof(Vector3);
-                }
-                
-                // how about tangents?
-                
-                // copy everything else excluding what's copied already
-                memcpy(pDataAlign, pOrigDataAlign, sizeRemaining);
-            }
-        }
+    instanceList_.Resize(numInstances);
 
-        //unlock
-        pVbuffer->Unlock();
+    // laid out in streams: positions, rotations, scales then normals
+    for ( unsigned i = 0; i < numInstances; ++i )
+    {
+        Vector3 &pos = instanceList_[i].pos;
+        pos.x_ = DequantizeRange(buf.ReadUShort(), posMin.x_, posRange.x_, 65535);
+        pos.y_ = DequantizeRange(buf.ReadUShort(), posMin.y_, posRange.y_, 65535);
+        pos.z_ = DequantizeRange(buf.ReadUShort(), posMin.z_, posRange.z_, 65535);
     }
 
-    // replicate indeces
-    unsigned newIdxCount = ReplicateIndeces(pIbuffer, numVertices, qplist.Size());
+    for ( unsigned i = 0; i < numInstances; ++i )
+    {
+        if ( rotFormat == RotFormat_Yaw16 )
+        {
+            instanceList_[i].rot = Quaternion(0.0f, (float)buf.ReadUShort() * 360.0f / 65536.0f, 0.0f);
+        }
+        else
+        {
+            instanceList_[i].rot = DecodeSmallestThree(buf.ReadUInt());
+        }
+    }
 
-    // set draw range and bounding box
-    pGeometry->SetDrawRange(TRIANGLE_LIST, 0, newIdxCount);
-    SetBoundingBox( bbox );
+    for ( unsigned i = 0; i < numInstances; ++i )
+    {
+        instanceList_[i].scale = DequantizeRange(buf.ReadUByte(), scaleMin, scaleRange, 255);
+    }
 
-    return qplist.Size();
+    for ( unsigned i = 0; i < numInstances; ++i )
+    {
+        instanceList_[i].normal = (flags & InstanceFlag_Normals) ? DecodeOctNormal(buf.ReadUShort()) : Vector3::ZERO;
+    }
 }
 
-unsigned GeomReplicator::ReplicateIndeces(IndexBuffer *idxbuffer, unsigned numVertices, unsigned expandSize)
+PODVector<unsigned char> GeomReplicator::GetInstancesAttr() const
 {
-    unsigned numIndeces = idxbuffer->GetIndexCount();
-    unsigned origIdxBuffSize = numIndeces * sizeof(unsigned short);
-    unsigned newIdxCount = expandSize * numIndeces;
-    bool isOver64k = newIdxCount > 1024*64;
-    SharedArrayPtr<unsigned short> origIdxBuff( new unsigned short[numIndeces] );
+    VectorBuffer buf;
 
-    // copy orig indeces
-    void *pIndexData = (void*)idxbuffer->Lock(0, idxbuffer->GetIndexCount());
+    if ( instanceList_.Empty() )
+        return buf.GetBuffer();
 
-    if (pIndexData)
-    {
-        memcpy(origIdxBuff.Get(), pIndexData, origIdxBuffSize);
-        idxbuffer->Unlock();
-    }
+    // quantization ranges
+    BoundingBox posBox;
+    float scaleMin = M_INFINITY;
+    float scaleMax = -M_INFINITY;
+    bool yawOnly = true;
+    bool hasNormals = false;
 
-    // replicate indeces
-    if (isOver64k)
+    for ( unsigned i = 0; i < instanceList_.Size(); ++i )
     {
-        PODVector<int> newIndexList(newIdxCount);
+        const PRotScale &qp = instanceList_[i];
 
-        for (unsigned i = 0; i < expandSize; ++i)
+        if ( qp.normal != Vector3::ZERO )
         {
-            for (unsigned j = 0; j < numIndeces; ++j)
-            {
-                newIndexList[i*numIndeces + j] = i*numVertices + origIdxBuff[j];
-            }
+            hasNormals = true;
         }
 
-        idxbuffer->SetSize(newIdxCount, true);
-        idxbuffer->SetData(&newIndexList[0]);
+        posBox.Merge(qp.pos);
+        scaleMin = Min(scaleMin, qp.scale);
+        scaleMax = Max(scaleMax, qp.scale);
+
+        if ( Abs(qp.rot.x_) > YawOnlyEpsilon || Abs(qp.rot.z_) > YawOnlyEpsilon )
+        {
+            yawOnly = false;
+        }
     }
-    else
+
+    Vector3 posRange = posBox.max_ - posBox.min_;
+    float scaleRange = scaleMax - scaleMin;
+
+    buf.WriteUByte(InstanceFormat_Version);
+    buf.WriteUByte(yawOnly ? RotFormat_Yaw16 : RotFormat_SmallestThree32);
+    buf.WriteUByte(hasNormals ? InstanceFlag_Normals : 0);
+    buf.WriteVLE(instanceList_.Size());
+    buf.WriteVector3(posBox.min_);
+    buf.WriteVector3(posBox.max_);
+    buf.WriteFloat(scaleMin);
+    buf.WriteFloat(scaleMax);
+
+    for ( unsigned i = 0; i < instanceList_.Size(); ++i )
     {
-        PODVector<unsigned short> newIndexList(newIdxCount);
+        const Vector3 &pos = instanceList_[i].pos;
+        buf.WriteUShort((unsigned short)QuantizeRange(pos.x_, posBox.min_.x_, posRange.x_, 65535));
+        buf.WriteUShort((unsigned short)QuantizeRange(pos.y_, posBox.min_.y_, posRange.y_, 65535));
+        buf.WriteUShort((unsigned short)QuantizeRange(pos.z_, posBox.min_.z_, posRange.z_, 65535));
+    }
 
-        for (unsigned i = 0; i < expandSize; ++i)
+    for ( unsigned i = 0; i < instanceList_.Size(); ++i )
+    {
+        if ( yawOnly )
         {
-            for (unsigned j = 0; j < numIndeces; ++j)
-            {
-                newIndexList[i*numIndeces + j] = i*numVertices + origIdxBuff[j];
-            }
+            float yaw = instanceList_[i].rot.YawAngle();
+            if ( yaw < 0.0f ) yaw += 360.0f;
+
+            buf.WriteUShort((unsigned short)((unsigned)(yaw * 65536.0f / 360.0f + 0.5f) & 0xffff));
+        }
+        else
+        {
+            buf.WriteUInt(EncodeSmallestThree(instanceList_[i].rot));
         }
+    }
 
-        idxbuffer->SetSize(newIdxCount, false);
-        idxbuffer->SetData(&newIndexList[0]);
+    for ( unsigned i = 0; i < instanceList_.Size(); ++i )
+    {
+        buf.WriteUByte((unsigned char)QuantizeRange(instanceList_[i].scale, scaleMin, scaleRange, 255));
+    }
+
+    if ( hasNormals )
+    {
+        for ( unsigned i = 0; i < instanceList_.Size(); ++i )
+        {
+            // mixed lists store up for the instances without a ground normal
+            const Vector3 &normal = instanceList_[i].normal;
+            buf.WriteUShort(EncodeOctNormal(normal != Vector3::ZERO ? normal : Vector3::UP));
+        }
     }
 
-    return newIdxCount;
+    return buf.GetBuffer();
 }
 
 bool GeomReplicator::ConfigWindVelocity(const PODVector<unsigned> &vertIndecesToMove, unsigned batchCount, 
@@ -344,7 +1338,8 @@ void GeomReplicator::AnimateVerts()
                 unsigned char *pDataAlign = (unsigned char *)(pVertexData + (i*numVertsPerGeom + vertIndecesToMove_[j]) * vertexSize );
 
                 Vector3 &pos = *reinterpret_cast<Vector3*>( pDataAlign );
-                pos = animatedVertexList_[vertIdx].origPos + animatedVertexList_[vertIdx].deltaMovement;
+                pos = animatedVertexList_[vertIdx].origPos + animatedVertexList_[vertIdx].deltaMovement + 
+                      instanceBendList_[currentVertexIdx_ + i].offset;
             }
         }
 
@@ -362,7 +1357,70 @@ void GeomReplicator::AnimateVerts()
 
 void GeomReplicator::WindAnimationEnabled(bool enable)
 {
-    if (enable)
+    windEnabled_ = enable;
+
+    UpdateEventSubscription();
+}
+
+void GeomReplicator::ConfigInteraction(float cellSize, float decayRate)
+{
+    assert(cellSize > 0.0f && "cell size must be greater than zero");
+
+    decayRate_ = decayRate;
+
+    if ( cellSize != cellSize_ )
+    {
+        cellSize_ = cellSize;
+        BuildSpatialHash();
+    }
+}
+
+void GeomReplicator::InteractionEnabled(bool enable)
+{
+    if ( enable && vertIndecesToMove_.Empty() )
+    {
+        URHO3D_LOGWARNING("GeomReplicator interaction bends the wind verts, call ConfigWindVelocity() first");
+    }
+
+    // straighten what's still bent, nothing decays it once disabled
+    if ( !enable && interactionEnabled_ )
+    {
+        for ( unsigned i = 0; i < bentInstanceList_.Size(); ++i )
+        {
+            instanceBendList_[bentInstanceList_[i]].offset = Vector3::ZERO;
+        }
+
+        UpdateBentVerts();
+
+        for ( unsigned i = 0; i < bentInstanceList_.Size(); ++i )
+        {
+            instanceBendList_[bentInstanceList_[i]].active = false;
+        }
+
+        bentInstanceList_.Clear();
+    }
+
+    interactionEnabled_ = enable;
+    interactSphereList_.Clear();
+
+    UpdateEventSubscription();
+}
+
+void GeomReplicator::AddInteractSphere(const Vector3 &center, float radius, float strength)
+{
+    if ( !interactionEnabled_ )
+        return;
+
+    InteractSphere sphere;
+    sphere.center   = center;
+    sphere.radius   = radius;
+    sphere.strength = strength;
+    interactSphereList_.Push(sphere);
+}
+
+void GeomReplicator::UpdateEventSubscription()
+{
+    if ( windEnabled_ || interactionEnabled_ || IsBaking() )
     {
         SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(GeomReplicator, HandleUpdate));
     }
@@ -372,6 +1430,170 @@ void GeomReplicator::WindAnimationEnabled(bool enable)
     }
 }
 
+void GeomReplicator::BuildSpatialHash()
+{
+    spatialHash_.Clear();
+
+    // bucket instances by their xz cell, positions are in node space
+    for ( unsigned i = 0; i < instancePosList_.Size(); ++i )
+    {
+        int x = FloorToInt(instancePosList_[i].x_ / cellSize_);
+        int z = FloorToInt(instancePosList_[i].z_ / cellSize_);
+
+        spatialHash_[CellKey(x, z)].Push(i);
+    }
+}
+
+void GeomReplicator::ApplyInteractSpheres(float timeStep)
+{
+    // decay what's bent from previous frames, UpdateBentVerts() retires the ones that have settled
+    float decay = expf(-decayRate_ * timeStep);
+
+    for ( unsigned i = 0; i < bentInstanceList_.Size(); ++i )
+    {
+        instanceBendList_[bentInstanceList_[i]].offset *= decay;
+    }
+
+    // nothing to bend
+    if ( interactSphereList_.Empty() || vertIndecesToMove_.Empty() || !node_ )
+    {
+        interactSphereList_.Clear();
+        return;
+    }
+
+    // spheres are in world space, instances in node space
+    Matrix3x4 invWorld = node_->GetWorldTransform().Inverse();
+    float invScale = 1.0f / node_->GetWorldScale().x_;
+
+    for ( unsigned s = 0; s < interactSphereList_.Size(); ++s )
+    {
+        const InteractSphere &sphere = interactSphereList_[s];
+        Vector3 center = invWorld * sphere.center;
+        float radius = sphere.radius * invScale;
+        float strength = sphere.strength * invScale;
+
+        if ( radius <= 0.0f )
+            continue;
+
+        int x0 = FloorToInt((center.x_ - radius) / cellSize_);
+        int x1 = FloorToInt((center.x_ + radius) / cellSize_);
+        int z0 = FloorToInt((center.z_ - radius) / cellSize_);
+        int z1 = FloorToInt((center.z_ + radius) / cellSize_);
+
+        for ( int x = x0; x <= x1; ++x )
+        {
+            for ( int z = z0; z <= z1; ++z )
+            {
+                HashMap<unsigned, PODVector<unsigned> >::ConstIterator itCell = spatialHash_.Find(CellKey(x, z));
+
+                if ( itCell == spatialHash_.End() )
+                    continue;
+
+                const PODVector<unsigned> &cell = itCell->second_;
+
+                for ( unsigned c = 0; c < cell.Size(); ++c )
+                {
+                    unsigned instIdx = cell[c];
+                    Vector3 dir = instancePosList_[instIdx] - center;
+                    float dist = dir.Length();
+
+                    if ( dist >= radius )
+                        continue;
+
+                    // push away from the center sideways and press down, strongest at the center
+                    float falloff = (1.0f - dist / radius) * strength;
+                    dir.y_ = 0.0f;
+                    float distXZ = dir.Length();
+                    Vector3 offset = distXZ > M_EPSILON ? dir * (falloff / distXZ) : Vector3::ZERO;
+                    offset.y_ = -0.5f * falloff;
+
+                    InstanceBend &bend = instanceBendList_[instIdx];
+
+                    if ( offset.LengthSquared() > bend.offset.LengthSquared() )
+                    {
+                        bend.offset = offset;
+                    }
+
+                    if ( !bend.active )
+                    {
+                        bend.active = true;
+                        bentInstanceList_.Push(instIdx);
+                    }
+                }
+            }
+        }
+    }
+
+    interactSphereList_.Clear();
+}
+
+void GeomReplicator::UpdateBentVerts()
+{
+    if ( bentInstanceList_.Empty() || vertIndecesToMove_.Empty() )
+        return;
+
+    Geometry *pGeometry = GetModel()->GetGeometry(0, 0);
+    VertexBuffer *pVbuffer = pGeometry->GetVertexBuffer(0);
+    unsigned vertexSize = pVbuffer->GetVertexSize();
+
+    // sort so that adjacent instances are uploaded with a single lock
+    Sort(bentInstanceList_.Begin(), bentInstanceList_.End());
+
+    unsigned beg = 0;
+
+    while ( beg < bentInstanceList_.Size() )
+    {
+        unsigned end = beg + 1;
+
+        while ( end < bentInstanceList_.Size() && bentInstanceList_[end] == bentInstanceList_[end - 1] + 1 )
+        {
+            ++end;
+        }
+
+        unsigned firstInst = bentInstanceList_[beg];
+        unsigned numInst = end - beg;
+        unsigned char *pVertexData = (unsigned char*)pVbuffer->Lock(firstInst * numVertsPerGeom, numInst * numVertsPerGeom);
+
+        if ( pVertexData )
+        {
+            for ( unsigned i = 0; i < numInst; ++i )
+            {
+                unsigned instIdx = firstInst + i;
+                InstanceBend &bend = instanceBendList_[instIdx];
+
+                // settled - write the rest position and retire
+                if ( bend.offset.LengthSquared() < MinBendLength * MinBendLength )
+                {
+                    bend.offset = Vector3::ZERO;
+                    bend.active = false;
+                }
+
+                for ( unsigned j = 0; j < vertIndecesToMove_.Size(); ++j )
+                {
+                    unsigned vertIdx = instIdx * numVertsPerGeom + vertIndecesToMove_[j];
+                    unsigned char *pDataAlign = (unsigned char *)(pVertexData + (i*numVertsPerGeom + vertIndecesToMove_[j]) * vertexSize );
+
+                    Vector3 &pos = *reinterpret_cast<Vector3*>( pDataAlign );
+                    pos = animatedVertexList_[vertIdx].origPos + animatedVertexList_[vertIdx].deltaMovement + bend.offset;
+                }
+            }
+
+            pVbuffer->Unlock();
+        }
+
+        beg = end;
+    }
+
+    // remove retired
+    for ( unsigned i = bentInstanceList_.Size(); i-- > 0; )
+    {
+        if ( !instanceBendList_[bentInstanceList_[i]].active )
+        {
+            bentInstanceList_.EraseSwap(i);
+        }
+    }
+}
+
 void GeomReplicator::ShowGeomVertIndeces(bool show)
 {
     #ifdef VERT_INDEX_VISUAL
@@ -387,7 +1609,7 @@ void GeomReplicator::ShowGeomVertIndeces(bool show)
 void GeomReplicator::RenderGeomVertIndeces()
 {
     #ifdef VERT_INDEX_VISUAL
-    if ( showGeomVertIndeces_ )
+    if ( showGeomVertIndeces_ && !nodeText3DVertList_.Empty() )
     {
         DebugRenderer *dbgRenderer = GetScene()->GetComponent<DebugRenderer>();
 
@@ -406,13 +1628,27 @@ void GeomReplicator::HandleUpdate(StringHash eventType, VariantMap& eventData)
 
     float timeStep = eventData[P_TIMESTEP].GetFloat();
 
-    if ( timerUpdate_.GetMSec(false) >= FrameRate_MSec )
+    // animation and interaction resume once the whole field is published
+    if ( IsBaking() )
+    {
+        interactSphereList_.Clear();
+        PublishBakedChunks();
+        return;
+    }
+
+    if ( windEnabled_ && timerUpdate_.GetMSec(false) >= FrameRate_MSec )
     {
         AnimateVerts();
 
         timerUpdate_.Reset();
     }
 
+    if ( interactionEnabled_ )
+    {
+        ApplyInteractSpheres(timeStep);
+        UpdateBentVerts();
+    }
+
     RenderGeomVertIndeces();
 }
 
@@ -424,6 +1660,7 @@ StaticScene::StaticScene(Context* context) :
     Sample(context)
     , framesCount_(0)
     , timeToLoad_(0)
+    , timeToBake_(0)
 {
     GeomReplicator::RegisterObject(context);
 }
@@ -458,17 +1695,21 @@ void StaticScene::CreateScene()
     ResourceCache* cache = GetSubsystem<ResourceCache>();
 
     fpsTimer_.Reset();
+    bakeTimer_.Reset();
 
     scene_ = new Scene(context_);
 
     scene_->CreateComponent<Octree>();
     scene_->CreateComponent<DebugRenderer>();
 
-    Node* planeNode = scene_->CreateChild("Plane");
-    planeNode->SetScale(Vector3(100.0f, 1.0f, 100.0f));
-    StaticModel* planeObject = planeNode->CreateComponent<StaticModel>();
-    planeObject->SetModel(cache->GetResource<Model>("Models/Plane.mdl"));
-    planeObject->SetMaterial(cache->GetResource<Material>("Materials/StoneTiled.xml"));
+    Node* terrainNode = scene_->CreateChild("Terrain");
+    Terrain* terrain = terrainNode->CreateComponent<Terrain>();
+    terrain_ = terrain;
+    terrain->SetPatchSize(64);
+    terrain->SetSpacing(Vector3(0.1f, 0.02f, 0.1f));
+    terrain->SetSmoothing(true);
+    terrain->SetHeightMap(cache->GetResource<Image>("Textures/HeightMap.png"));
+    terrain->SetMaterial(cache->GetResource<Material>("Materials/Terrain.xml"));
 
     Node* lightNode = scene_->CreateChild("DirectionalLight");
     Vector3 lightDir(0.6f, -1.0f, 0.8f);
@@ -487,60 +1728,111 @@ void StaticScene::CreateScene()
         qp.rot = Quaternion(0.0f, Random(360.0f), 0.0f);
         qp.scale = 0.5f + Random(2.0f);
         qpList_.Push(qp);
+    }
 
-        if ( loadNodes )
+    // snap to the terrain and lean with the slope, nothing grows on the steep parts
+    nodeRep_ = scene_->CreateChild("Vegrep");
+    vegReplicator_ = nodeRep_->CreateComponent<GeomReplicator>();
+    vegReplicator_->ConformToTerrain(terrain, qpList_, true, 35.0f);
+
+    if ( loadNodes )
+    {
+        for (unsigned i = 0; i < qpList_.Size(); ++i)
         {
             Node* mushroomNode = scene_->CreateChild("Vegbrush");
-            mushroomNode->SetPosition(qp.pos);
-            mushroomNode->SetRotation(qp.rot);
-            mushroomNode->SetScale(qp.scale);
+            mushroomNode->SetPosition(qpList_[i].pos);
+            mushroomNode->SetRotation(qpList_[i].rot);
+            mushroomNode->SetScale(qpList_[i].scale);
             StaticModel* mushroomObject = mushroomNode->CreateComponent<StaticModel>();
             mushroomObject->SetModel(cache->GetResource<Model>("Models/Veg/vegbrush.mdl"));
             mushroomObject->SetMaterial(cache->GetResource<Material>("Models/Veg/veg-alphamask.xml"));
         }
     }
-
-    if ( !loadNodes )
+    else
     {
         Model *pModel = cache->GetResource<Model>("Models/Veg/vegbrush.mdl");
-        SharedPtr<Model> cloneModel = pModel->Clone();
 
-        nodeRep_ = scene_->CreateChild("Vegrep");
-        vegReplicator_ = nodeRep_->CreateComponent<GeomReplicator>();
-        vegReplicator_->SetModel( cloneModel );
+        vegReplicator_->SetSourceModel( pModel );
         vegReplicator_->SetMaterial(cache->GetResource<Material>("Models/Veg/veg-alphamask.xml"));
 
-        lightDir = -1.0f * lightDir.Normalized();
-        vegReplicator_->Replicate(qpList_, lightDir );
+        // bake in the background, nearest to the camera first
+        // - lit with the ground normals set by ConformToTerrain(), no normal override
+        SubscribeToEvent(vegReplicator_, E_GEOMREPLICATIONCOMPLETED, URHO3D_HANDLER(StaticScene, HandleReplicationCompleted));
+        vegReplicator_->ReplicateAsync(qpList_, Vector3::ZERO, CameraStartPos );
+
+        ConfigReplicator();
+    }
+
+    // camera, outside the scene so that loading it doesn't remove it
+    cameraNode_ = new Node(context_);
+    cameraNode_->CreateComponent<Camera>();
 
-        // specify which verts in the geom to move
-        // - for the vegbrush model, the top two vertex indeces are 2 and 3
-        PODVector<unsigned> topVerts;
-        topVerts.Push(2);
-        topVerts.Push(3);
+    // Set an initial position for the camera scene node above the terrain
+    cameraNode_->SetPosition(CameraStartPos + Vector3(0.0f, terrain->GetHeight(CameraStartPos), 0.0f));
 
-        // specify the number of geoms to update at a time
-        unsigned batchCount = 10000;
+    timeToLoad_ = fpsTimer_.GetMSec(true);
+}
 
-        // wind velocity (breeze velocity shown)
-        Vector3 windVel(0.2f, -0.2f, 0.2f);
+void StaticScene::ConfigReplicator()
+{
+    // wind and interaction are runtime settings, not saved with the scene
 
-        // specify the cycle timer
-        float cycleTimer = 0.4f;
+    // specify which verts in the geom to move
+    // - for the vegbrush model, the top two vertex indeces are 2 and 3
+    PODVector<unsigned> topVerts;
+    topVerts.Push(2);
+    topVerts.Push(3);
 
-        vegReplicator_->ConfigWindVelocity(topVerts, batchCount, windVel, cycleTimer);
-        vegReplicator_->WindAnimationEnabled(true);
-        vegReplicator_->ShowGeomVertIndeces(true);
-    }
+    // specify the number of geoms to update at a time
+    unsigned batchCount = 10000;
 
-    // camera
-    cameraNode_ = scene_->CreateChild("Camera");
-    cameraNode_->CreateComponent<Camera>();
+    // wind velocity (breeze velocity shown)
+    Vector3 windVel(0.2f, -0.2f, 0.2f);
 
-    // Set an initial position for the camera scene node above the plane
-    cameraNode_->SetPosition(Vector3(-4.0f, 3.0f, -50.0f));
+    // specify the cycle timer
+    float cycleTimer = 0.4f;
 
-    timeToLoad_ = fpsTimer_.GetMSec(true);
+    vegReplicator_->ConfigWindVelocity(topVerts, batchCount, windVel, cycleTimer);
+    vegReplicator_->WindAnimationEnabled(true);
+    vegReplicator_->ShowGeomVertIndeces(true);
+
+    // grass bends away from the camera as it moves through the field
+    vegReplicator_->InteractionEnabled(true);
+}
+
+void StaticScene::SaveScene()
+{
+    // the replicator saves its instance list, not the baked geometry
+    File saveFile(context_, GetSubsystem<FileSystem>()->GetProgramDir() + "Data/Scenes/GeomReplicator.xml", FILE_WRITE);
+    scene_->SaveXML(saveFile);
+}
+
+void StaticScene::LoadScene()
+{
+    File loadFile(context_, GetSubsystem<FileSystem>()->GetProgramDir() + "Data/Scenes/GeomReplicator.xml", FILE_READ);
+
+    if ( !loadFile.IsOpen() )
+        return;
+
+    Timer loadTimer;
+    bakeTimer_.Reset();
+    timeToBake_ = 0;
+
+    // the replicator re-bakes in the background once its attributes are applied
+    if ( !scene_->LoadXML(loadFile) )
+        return;
+
+    timeToLoad_ = loadTimer.GetMSec(false);
+
+    terrain_ = scene_->GetComponent<Terrain>(true);
+    vegReplicator_ = scene_->GetComponent<GeomReplicator>(true);
+    nodeRep_ = vegReplicator_ ? vegReplicator_->GetNode() : 0;
+
+    if ( vegReplicator_ )
+    {
+        SubscribeToEvent(vegReplicator_, E_GEOMREPLICATIONCOMPLETED, URHO3D_HANDLER(StaticScene, HandleReplicationCompleted));
+        ConfigReplicator();
+    }
 }
 
 void StaticScene::CreateStatusText()
@@ -604,6 +1896,29 @@ void StaticScene::HandleUpdate(StringHash eventType, VariantMap& eventData)
 
     MoveCamera(timeStep);
 
+    // save and load the scene
+    Input* input = GetSubsystem<Input>();
+
+    if ( !GetSubsystem<UI>()->GetFocusElement() )
+    {
+        if ( input->GetKeyPress(KEY_F5) )
+        {
+            SaveScene();
+        }
+        if ( input->GetKeyPress(KEY_F7) )
+        {
+            LoadScene();
+        }
+    }
+
+    if ( vegReplicator_ )
+    {
+        // walk the sphere along the ground under the camera
+        Vector3 camPos = cameraNode_->GetPosition();
+        float groundY = terrain_ ? terrain_->GetHeight(camPos) : 0.0f;
+        vegReplicator_->AddInteractSphere(Vector3(camPos.x_, groundY, camPos.z_), 2.5f, 0.6f);
+    }
+
     framesCount_++;
     if ( fpsTimer_.GetMSec(false) >= ONE_SEC_DURATION )
     {
@@ -617,10 +1932,11 @@ void StaticScene::HandleUpdate(StringHash eventType, VariantMap& eventData)
         sprintf(buff, "%.1f", cameraNode_->GetPosition().z_);
         z = String(buff);
 
-        stat.AppendWithFormat( "tris: %d fps: %d load time: %d msec", 
+        stat.AppendWithFormat( "tris: %d fps: %d load time: %d msec bake time: %d msec  (F5 save, F7 load)", 
                                renderer->GetNumPrimitives(),
                                framesCount_,
-                               timeToLoad_);
+                               timeToLoad_,
+                               timeToBake_);
         //stat += x + y + z;
         textStatus_->SetText(stat);
         framesCount_ = 0;
@@ -628,3 +1944,8 @@ void StaticScene::HandleUpdate(StringHash eventType, VariantMap& eventData)
     }
 
 }
+
+void StaticScene::HandleReplicationCompleted(StringHash eventType, VariantMap& eventData)
+{
+    timeToBake_ = bakeTimer_.GetMSec(false);
+}
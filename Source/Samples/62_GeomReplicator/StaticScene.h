@@ -28,16 +28,76 @@ namespace Urho3D
 {
 class Node;
 class Scene;
+class Terrain;
 class Text3D;
+struct WorkItem;
 }
 
 //=============================================================================
 //=============================================================================
+/// GeomReplicator async replication completed.
+URHO3D_EVENT(E_GEOMREPLICATIONCOMPLETED, GeomReplicationCompleted)
+{
+    URHO3D_PARAM(P_NODE, Node);                     // Node pointer
+    URHO3D_PARAM(P_NUMINSTANCES, NumInstances);     // unsigned
+}
+
 struct PRotScale
 {
     Vector3     pos;
     Quaternion  rot;
     float       scale;
+    Vector3     normal;     // ground normal for lighting, ZERO falls back to the normal override, then the rotated geom normals
+};
+
+struct InteractSphere
+{
+    Vector3     center;
+    float       radius;
+    float       strength;
+};
+
+// decoded source geom, shared by every replicator of the same model and never modified once built
+class GeomPrototype : public RefCounted
+{
+public:
+    GeomPrototype(Model *model);
+
+    bool IsValid() const                            { return numIndeces_ > 0; }
+    Model* GetSourceModel() const                   { return sourceModel_; }
+    const unsigned char* GetVertexData() const      { return vertexData_.Get(); }
+    const unsigned short* GetIndexData() const      { return indexData_.Get(); }
+    unsigned GetElementMask() const                 { return elementMask_; }
+    unsigned GetVertexSize() const                  { return vertexSize_; }
+    unsigned GetNumVertices() const                 { return numVertices_; }
+    unsigned GetNumIndeces() const                  { return numIndeces_; }
+
+protected:
+    WeakPtr<Model>                  sourceModel_;
+    SharedArrayPtr<unsigned char>   vertexData_;
+    SharedArrayPtr<unsigned short>  indexData_;
+    unsigned                        elementMask_;
+    unsigned                        vertexSize_;
+    unsigned                        numVertices_;
+    unsigned                        numIndeces_;
+};
+
+class GeomPrototypeCache : public Object
+{
+    URHO3D_OBJECT(GeomPrototypeCache, Object);
+
+public:
+    GeomPrototypeCache(Context *context)
+        : Object(context)
+    {
+    }
+
+    // stale - the caller's prototype, rebuilt if it's still the cached one
+    GeomPrototype* GetPrototype(Model *model, GeomPrototype *stale=0);
+    void ReleaseUnused();
+
+protected:
+    HashMap<Model*, SharedPtr<GeomPrototype> > prototypeMap_;
 };
 
 class GeomReplicator : public StaticModel
@@ -47,9 +107,8 @@ class GeomReplicator : public StaticModel
     struct MoveAccumulator
     {
         MoveAccumulator() 
-            : origPos(Vector3::ZERO), deltaMovement(Vector3::ZERO), reversing(false)
+            : origPos(Vector3::ZERO), deltaMovement(Vector3::ZERO), timeAccumlated(0.0f), reversing(false)
         {
-            timeAccumlated = Random() * 0.2f;
         }
 
         Vector3 origPos;
@@ -59,34 +118,132 @@ class GeomReplicator : public StaticModel
         bool    reversing;
     };
 
-public:
-    static void RegisterObject(Context* context)
+    struct InstanceBend
     {
-        context->RegisterFactory<GeomReplicator>();
-    }
+        InstanceBend()
+            : offset(Vector3::ZERO), active(false)
+        {
+        }
 
-    GeomReplicator(Context *context) 
-        : StaticModel(context), numVertsPerGeom(0), batchCount_(0), showGeomVertIndeces_(false)
+        Vector3 offset;
+        bool    active;
+    };
+
+    // cpu side of a replication, instance ranges are safe to fill on worker threads
+    struct BakeData
     {
-    }
+        BakeData() 
+            : largeIndices(false)
+        {
+        }
+
+        SharedArrayPtr<unsigned char>   vertexData;
+        SharedArrayPtr<unsigned char>   indexData;
+        bool                            largeIndices;
+        BoundingBox                     bbox;
+        PODVector<MoveAccumulator>      animatedVertexList;
+        PODVector<Vector3>              instancePosList;
+    };
+
+    // instance range baked by a single work item
+    struct BakeChunk
+    {
+        unsigned            begInst;
+        unsigned            endInst;
+        BoundingBox         bbox;
+        SharedPtr<WorkItem> workItem;
+        bool                baked;
+    };
+
+public:
+    static void RegisterObject(Context* context);
 
-    virtual ~GeomReplicator()
+    GeomReplicator(Context *context) 
+        : StaticModel(context), instancesDirty_(false), publishedChunks_(0), bakeCancelled_(false), 
+          numVertsPerGeom(0), batchCount_(0), 
+          windEnabled_(false), interactionEnabled_(false), cellSize_(DefaultCellSize), decayRate_(DefaultDecayRate),
+          showGeomVertIndeces_(false)
     {
     }
 
+    virtual ~GeomReplicator();
+
+    virtual void ApplyAttributes();
+
+    // source geom comes from the shared prototype cache, only the output buffers are owned
+    void SetSourceModel(Model *model);
+    Model* GetSourceModel() const { return sourceModel_; }
+
     unsigned Replicate(const PODVector<PRotScale> &qplist, const Vector3 &normalOverride=Vector3::ZERO);
+
+    // returns immediately, bakes on worker threads and publishes the instances nearest to
+    // priorityPos (world space) first - sends E_GEOMREPLICATIONCOMPLETED when done, returns false
+    // and sends nothing when there is nothing to bake
+    bool ReplicateAsync(const PODVector<PRotScale> &qplist, const Vector3 &normalOverride=Vector3::ZERO, 
+                        const Vector3 &priorityPos=Vector3::ZERO);
+    bool IsBaking() const { return !bakeChunks_.Empty(); }
+
+    // snaps the list (node space) onto the terrain in bulk, sets the ground normals and optionally aligns
+    // to the slope - instances steeper than maxSlope (degrees) are removed, returns the number kept
+    // or 0 with the list untouched if the terrain has no height data
+    unsigned ConformToTerrain(Terrain *terrain, PODVector<PRotScale> &qplist, bool alignToSlope=false, float maxSlope=90.0f);
     bool ConfigWindVelocity(const PODVector<unsigned> &vertIndecesToMove, unsigned batchCount, 
                             const Vector3 &velocity, float cycleTimer);
     void WindAnimationEnabled(bool enable);
     void ShowGeomVertIndeces(bool show);
 
+    // actor interaction - spheres are in world space and must be re-added every frame
+    // - bends the verts given to ConfigWindVelocity(), so that must be called first
+    void ConfigInteraction(float cellSize, float decayRate);
+    void InteractionEnabled(bool enable);
+    void AddInteractSphere(const Vector3 &center, float radius, float strength);
+
+    // attributes
+    void SetSourceModelAttr(const ResourceRef& value);
+    ResourceRef GetSourceModelAttr() const;
+    void SetInstancesAttr(const PODVector<unsigned char>& value);
+    PODVector<unsigned char> GetInstancesAttr() const;
+
 protected:
-    unsigned ReplicateIndeces(IndexBuffer *idxbuffer, unsigned numVertices, unsigned expandSize);
+    virtual void OnNodeSet(Node* node);
+    void ReleasePrototype();
+
+    bool PrepareBake(const PODVector<PRotScale> &qplist, const Vector3 &normalOverride);
+    void BakeVerts(unsigned begInst, unsigned endInst, BoundingBox &bbox);
+    void BakeIndeces(unsigned begInst, unsigned endInst);
+    void CommitBake();
+    void FinalizeBake();
+    bool StartAsyncBake(const Vector3 &normalOverride);
+    void PublishBakedChunks();
+    void CancelBake();
+    void ClearReplication();
+    void ClearReplicatedState();
+    static void BakeChunkWork(const WorkItem* item, unsigned threadIndex);
+    void HandleBakeCompleted(StringHash eventType, VariantMap& eventData);
+    void HandleSourceReloaded(StringHash eventType, VariantMap& eventData);
     void AnimateVerts();
+    void BuildSpatialHash();
+    void ApplyInteractSpheres(float timeStep);
+    void UpdateBentVerts();
+    void UpdateEventSubscription();
+    unsigned CellKey(int x, int z) const { return ((unsigned)(x & 0xffff) << 16) | (unsigned)(z & 0xffff); }
     void RenderGeomVertIndeces();
     void HandleUpdate(StringHash eventType, VariantMap& eventData);
 
 protected:
+    SharedPtr<Model>            sourceModel_;
+    SharedPtr<GeomPrototype>    prototype_;
+    PODVector<PRotScale>        instanceList_;
+    Vector3                     normalOverride_;
+    bool                        instancesDirty_;
+
+    // replication
+    BakeData                    bake_;
+    Vector<BakeChunk>           bakeChunks_;
+    unsigned                    publishedChunks_;
+    BoundingBox                 publishedBox_;
+    volatile bool               bakeCancelled_;
+
     PODVector<MoveAccumulator>  animatedVertexList_;
     PODVector<unsigned>         vertIndecesToMove_;
 
@@ -97,6 +254,17 @@ protected:
     Vector3                     windVelocity_;
     float                       cycleTimer_;
     float                       timeStepAccum_;
+    bool                        windEnabled_;
+
+    // actor interaction
+    PODVector<Vector3>          instancePosList_;
+    PODVector<InstanceBend>     instanceBendList_;
+    PODVector<unsigned>         bentInstanceList_;
+    PODVector<InteractSphere>   interactSphereList_;
+    HashMap<unsigned, PODVector<unsigned> > spatialHash_;
+    bool                        interactionEnabled_;
+    float                       cellSize_;
+    float                       decayRate_;
 
     // dbg
     Vector<Node*>               nodeText3DVertList_;
@@ -105,6 +273,16 @@ protected:
 protected:
     enum FrameRateType { FrameRate_MSec = 32    };
     enum MaxTimeType   { MaxTime_Elapsed = 1000 };
+    enum InstanceFormatType { InstanceFormat_Version = 1 };
+    enum InstanceFlagType { InstanceFlag_Normals = 1 };
+    enum RotFormatType { RotFormat_Yaw16, RotFormat_SmallestThree32 };
+    enum BakeChunkType { BakeChunk_Instances = 1000 };
+    enum PublishType   { Publish_MaxChunksPerFrame = 8 };
+    enum ConformWorkType { ConformWork_MinInstances = 2000 };
+
+    static const float DefaultCellSize;
+    static const float DefaultDecayRate;
+    static const float MinBendLength;
 };
 
 //=============================================================================
@@ -121,11 +299,15 @@ public:
 
 protected:
     void CreateScene();
+    void ConfigReplicator();
+    void SaveScene();
+    void LoadScene();
     void CreateStatusText();
     void SetupViewport();
     void MoveCamera(float timeStep);
     void SubscribeToEvents();
     void HandleUpdate(StringHash eventType, VariantMap& eventData);
+    void HandleReplicationCompleted(StringHash eventType, VariantMap& eventData);
 
 protected:
     WeakPtr<Text> textStatus_;
@@ -136,9 +318,12 @@ protected:
     PODVector<PRotScale> qpList_;
 
     unsigned      timeToLoad_;
+    unsigned      timeToBake_;
+    Timer         bakeTimer_;
     Timer         keyDebounceTimer_;
 
     // replicator
     SharedPtr<GeomReplicator> vegReplicator_;
     WeakPtr<Node> nodeRep_;
+    WeakPtr<Terrain> terrain_;
 };